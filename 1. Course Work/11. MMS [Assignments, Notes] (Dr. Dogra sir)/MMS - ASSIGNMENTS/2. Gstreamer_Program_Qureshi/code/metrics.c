@@ -0,0 +1,476 @@
+#include <gst/gst.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include "metrics.h"
+
+#define PENDING_BUFFERS 16 // Buffers an element may be working on at once (encoder lookahead, decoder delay)
+
+// Processing time of one element: from a buffer entering its sink pad to the buffer with the same PTS leaving its src pad
+typedef struct
+{
+    GstElement *element; // Not a reference, only to find the entry again when the element leaves the pipeline
+    gchar *name;
+    gint refs;           // The timings array and the two probes, whichever lets go last frees it
+    GstPad *sinkpad;
+    GstPad *srcpad;
+    gulong sink_probe;
+    gulong src_probe;
+    GMutex lock;
+    GstClockTime pending_pts[PENDING_BUFFERS];
+    GstClockTime pending_since[PENDING_BUFFERS]; // 0 once the buffer came out
+    guint next;
+    guint buffers; // Everything below is since the last report
+    GstClockTime total;
+    GstClockTime max;
+} ElementTiming;
+
+// What an element said in its QoS messages, i.e. that it dropped or is late with buffers
+typedef struct
+{
+    guint messages; // Since the last report
+    guint64 processed;
+    guint64 dropped;
+    gint64 jitter; // How late the last buffer was, negative when early
+    gdouble proportion;
+} ElementQos;
+
+struct _Metrics
+{
+    GstElement *pipeline;
+    const gchar *app;
+    GMainLoop *loop;
+    gulong element_added;
+    gulong element_removed;
+    GMutex lock;        // Guards timings, elements are added from streaming threads too
+    GPtrArray *timings; // ElementTiming
+    GHashTable *qos;    // Element name -> ElementQos, main loop only
+    guint warnings;
+    guint latency_changes;
+    gint buffering; // Last buffering percentage
+    guint interrupts;
+    gint result;
+    gint64 start;
+};
+
+// An element's share of one report, to sort the hot ones first
+typedef struct
+{
+    const gchar *name;
+    guint buffers;
+    GstClockTime total;
+    GstClockTime max;
+} TimingSample;
+
+// PTS of the buffer passing a probe, the first one of a list
+static GstClockTime probe_pts(GstPadProbeInfo *info)
+{
+    GstBufferList *list;
+    GstBuffer *buffer;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    {
+        list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        buffer = gst_buffer_list_length(list) > 0 ? gst_buffer_list_get(list, 0) : NULL;
+    }
+    else
+        buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    return buffer ? GST_BUFFER_PTS(buffer) : GST_CLOCK_TIME_NONE;
+}
+
+static GstPadProbeReturn on_buffer_in(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    ElementTiming *timing = user_data;
+    GstClockTime pts = probe_pts(info);
+
+    (void)pad;
+
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return GST_PAD_PROBE_OK;
+
+    g_mutex_lock(&timing->lock);
+    timing->pending_pts[timing->next] = pts;
+    timing->pending_since[timing->next] = gst_util_get_timestamp();
+    timing->next = (timing->next + 1) % PENDING_BUFFERS;
+    g_mutex_unlock(&timing->lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+// Only the first buffer out counts, e.g. the first RTP packet of a frame out of the payloader. Several buffers with
+// the same PTS can go in for it too (the RTP packets of a frame into the depayloader), so the time counts from the
+// oldest of them and all of them are done with
+static GstPadProbeReturn on_buffer_out(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    ElementTiming *timing = user_data;
+    GstClockTime pts = probe_pts(info), now = gst_util_get_timestamp(), elapsed;
+    gboolean matched = FALSE;
+    guint i, k;
+
+    (void)pad;
+
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return GST_PAD_PROBE_OK;
+
+    // next is the oldest slot (the one overwritten next), so go from there to the newest
+    g_mutex_lock(&timing->lock);
+    for (k = 0; k < PENDING_BUFFERS; k++)
+    {
+        i = (timing->next + k) % PENDING_BUFFERS;
+        if (timing->pending_since[i] == 0 || timing->pending_pts[i] != pts)
+            continue;
+
+        if (!matched)
+        {
+            elapsed = now - timing->pending_since[i];
+            timing->buffers++;
+            timing->total += elapsed;
+            timing->max = MAX(timing->max, elapsed);
+            matched = TRUE;
+        }
+        timing->pending_since[i] = 0;
+    }
+    g_mutex_unlock(&timing->lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void timing_unref(gpointer data)
+{
+    ElementTiming *timing = data;
+
+    if (!g_atomic_int_dec_and_test(&timing->refs))
+        return;
+
+    g_mutex_clear(&timing->lock);
+    g_free(timing->name);
+    g_free(timing);
+}
+
+// Take the probes off again, a buffer still in one of them keeps the timing alive until it is out
+static void unwatch_element(ElementTiming *timing)
+{
+    gst_pad_remove_probe(timing->sinkpad, timing->sink_probe);
+    gst_pad_remove_probe(timing->srcpad, timing->src_probe);
+    gst_object_unref(timing->sinkpad);
+    gst_object_unref(timing->srcpad);
+    timing_unref(timing);
+}
+
+// Time elements with one input and one output. Sources, sinks, tees, mixers and bins have no single path through
+// them, and the time a buffer spends in a queue is waiting rather than processing
+static void watch_element(Metrics *metrics, GstElement *element)
+{
+    GstElementFactory *factory = gst_element_get_factory(element);
+    GstPad *sinkpad, *srcpad;
+    ElementTiming *timing;
+
+    if (GST_IS_BIN(element) || (factory && g_str_equal(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "queue")))
+        return;
+
+    sinkpad = gst_element_get_static_pad(element, "sink");
+    srcpad = gst_element_get_static_pad(element, "src");
+    if (!sinkpad || !srcpad)
+    {
+        if (sinkpad)
+            gst_object_unref(sinkpad);
+        if (srcpad)
+            gst_object_unref(srcpad);
+        return;
+    }
+
+    // The timing keeps both pad references, unwatch_element() needs them to remove the probes
+    timing = g_new0(ElementTiming, 1);
+    timing->element = element;
+    timing->name = gst_element_get_name(element);
+    timing->refs = 3;
+    timing->sinkpad = sinkpad;
+    timing->srcpad = srcpad;
+    g_mutex_init(&timing->lock);
+    timing->sink_probe = gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                                           on_buffer_in, timing, timing_unref);
+    timing->src_probe = gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                                          on_buffer_out, timing, timing_unref);
+
+    g_mutex_lock(&metrics->lock);
+    g_ptr_array_add(metrics->timings, timing);
+    g_mutex_unlock(&metrics->lock);
+}
+
+// Elements added once the pipeline runs: rtpbin's per stream elements, the receiver's decoders
+static void on_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data)
+{
+    (void)bin;
+    (void)sub_bin;
+
+    watch_element(user_data, element);
+}
+
+// Elements taken out again, e.g. the receiver's decoder when a participant leaves. Its entry goes with it, or the
+// timings would grow with every participant that ever joined
+static void on_deep_element_removed(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data)
+{
+    Metrics *metrics = user_data;
+    ElementTiming *timing = NULL;
+    guint i;
+
+    (void)bin;
+    (void)sub_bin;
+
+    g_mutex_lock(&metrics->lock);
+    for (i = 0; i < metrics->timings->len; i++)
+    {
+        if (((ElementTiming *)g_ptr_array_index(metrics->timings, i))->element == element)
+        {
+            timing = g_ptr_array_remove_index_fast(metrics->timings, i);
+            break;
+        }
+    }
+    g_mutex_unlock(&metrics->lock);
+
+    if (timing)
+        unwatch_element(timing);
+}
+
+static void record_qos(Metrics *metrics, GstMessage *msg)
+{
+    ElementQos *qos = g_hash_table_lookup(metrics->qos, GST_OBJECT_NAME(msg->src));
+    GstFormat format;
+    guint64 processed, dropped;
+    gint quality;
+
+    if (!qos)
+    {
+        qos = g_new0(ElementQos, 1);
+        g_hash_table_insert(metrics->qos, g_strdup(GST_OBJECT_NAME(msg->src)), qos);
+    }
+
+    // The counters are totals since the element started, -1 when it does not keep them
+    gst_message_parse_qos_stats(msg, &format, &processed, &dropped);
+    gst_message_parse_qos_values(msg, &qos->jitter, &qos->proportion, &quality);
+    qos->messages++;
+    if (processed != (guint64)-1)
+        qos->processed = processed;
+    if (dropped != (guint64)-1)
+        qos->dropped = dropped;
+}
+
+static gboolean on_bus_message(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+    Metrics *metrics = user_data;
+    GError *err;
+    gchar *debug_info;
+
+    (void)bus;
+
+    switch (GST_MESSAGE_TYPE(msg))
+    {
+    case GST_MESSAGE_ERROR:
+        gst_message_parse_error(msg, &err, &debug_info);
+        g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
+        g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
+        g_clear_error(&err);
+        g_free(debug_info);
+        metrics->result = -1;
+        g_main_loop_quit(metrics->loop);
+        break;
+    case GST_MESSAGE_EOS:
+        g_print("End-Of-Stream reached.\n");
+        metrics->result = 0;
+        g_main_loop_quit(metrics->loop);
+        break;
+    case GST_MESSAGE_WARNING:
+        gst_message_parse_warning(msg, &err, &debug_info);
+        g_printerr("Warning from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
+        g_clear_error(&err);
+        g_free(debug_info);
+        metrics->warnings++;
+        break;
+    case GST_MESSAGE_QOS:
+        record_qos(metrics, msg);
+        break;
+    case GST_MESSAGE_LATENCY:
+        // An element's latency changed (a new participant, a jitter buffer), hand the sinks the new total
+        gst_bin_recalculate_latency(GST_BIN(metrics->pipeline));
+        metrics->latency_changes++;
+        break;
+    case GST_MESSAGE_BUFFERING:
+        // Live pipelines must not pause to buffer, only keep track of it
+        gst_message_parse_buffering(msg, &metrics->buffering);
+        break;
+    default:
+        break;
+    }
+
+    return TRUE;
+}
+
+static gint compare_samples(gconstpointer a, gconstpointer b)
+{
+    const TimingSample *x = a, *y = b;
+
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+// Print one JSON line: pipeline latency, then the elements by the time they spent on buffers (hottest first),
+// then every element that reported QoS
+static gboolean on_report(gpointer user_data)
+{
+    Metrics *metrics = user_data;
+    GString *line = g_string_new(NULL);
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(TimingSample));
+    GstQuery *query = gst_query_new_latency();
+    GstClockTime min_latency = 0, max_latency = 0;
+    gboolean live = FALSE, first = TRUE;
+    GHashTableIter iter;
+    gpointer name, value;
+    guint i;
+
+    if (gst_element_query(metrics->pipeline, query))
+        gst_query_parse_latency(query, &live, &min_latency, &max_latency);
+    gst_query_unref(query);
+
+    g_string_append_printf(line, "{\"app\":\"%s\",\"time\":%.1f,\"live\":%s,\"latency_ms\":%.1f,\"latency_changes\":%u,"
+                                 "\"warnings\":%u,\"buffering\":%d,\"elements\":[",
+                           metrics->app, (g_get_monotonic_time() - metrics->start) / 1e6, live ? "true" : "false",
+                           GST_CLOCK_TIME_IS_VALID(min_latency) ? min_latency / 1e6 : -1.0, metrics->latency_changes,
+                           metrics->warnings, metrics->buffering);
+
+    g_mutex_lock(&metrics->lock);
+    for (i = 0; i < metrics->timings->len; i++)
+    {
+        ElementTiming *timing = g_ptr_array_index(metrics->timings, i);
+        TimingSample sample;
+
+        g_mutex_lock(&timing->lock);
+        sample.name = timing->name;
+        sample.buffers = timing->buffers;
+        sample.total = timing->total;
+        sample.max = timing->max;
+        timing->buffers = 0;
+        timing->total = 0;
+        timing->max = 0;
+        g_mutex_unlock(&timing->lock);
+
+        if (sample.buffers > 0)
+            g_array_append_val(samples, sample);
+    }
+    g_mutex_unlock(&metrics->lock);
+
+    g_array_sort(samples, compare_samples);
+    for (i = 0; i < samples->len; i++)
+    {
+        TimingSample *sample = &g_array_index(samples, TimingSample, i);
+
+        g_string_append_printf(line, "%s{\"name\":\"%s\",\"buffers\":%u,\"avg_ms\":%.3f,\"max_ms\":%.3f,\"busy\":%.3f}",
+                               i > 0 ? "," : "", sample->name, sample->buffers, sample->total / 1e6 / sample->buffers,
+                               sample->max / 1e6, sample->total / 1e9 / METRICS_INTERVAL);
+    }
+    g_array_free(samples, TRUE);
+
+    g_string_append(line, "],\"qos\":[");
+    g_hash_table_iter_init(&iter, metrics->qos);
+    while (g_hash_table_iter_next(&iter, &name, &value))
+    {
+        ElementQos *qos = value;
+
+        g_string_append_printf(line, "%s{\"name\":\"%s\",\"messages\":%u,\"processed\":%" G_GUINT64_FORMAT ",\"dropped\":%" G_GUINT64_FORMAT
+                                     ",\"jitter_ms\":%.1f,\"proportion\":%.2f}",
+                               first ? "" : ",", (const gchar *)name, qos->messages, qos->processed, qos->dropped,
+                               qos->jitter / 1e6, qos->proportion);
+        qos->messages = 0;
+        first = FALSE;
+    }
+    g_string_append(line, "]}");
+
+    g_print("%s\n", line->str);
+    g_string_free(line, TRUE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+// Ctrl-C: let the pipeline finish with an EOS first, stop right away on the second one
+static gboolean on_interrupt(gpointer user_data)
+{
+    Metrics *metrics = user_data;
+
+    if (metrics->interrupts++ == 0)
+    {
+        g_print("Interrupted, sending EOS.\n");
+        gst_element_send_event(metrics->pipeline, gst_event_new_eos());
+    }
+    else
+    {
+        metrics->result = -1;
+        g_main_loop_quit(metrics->loop);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+Metrics *metrics_new(GstElement *pipeline, const gchar *app)
+{
+    Metrics *metrics = g_new0(Metrics, 1);
+    GstIterator *it;
+    GValue item = G_VALUE_INIT;
+
+    metrics->pipeline = pipeline;
+    metrics->app = app;
+    metrics->buffering = 100;
+    g_mutex_init(&metrics->lock);
+    metrics->timings = g_ptr_array_new();
+    metrics->qos = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    // Hook up to new elements first, so none is missed between the two
+    metrics->element_added = g_signal_connect(pipeline, "deep-element-added", G_CALLBACK(on_deep_element_added), metrics);
+    metrics->element_removed =
+        g_signal_connect(pipeline, "deep-element-removed", G_CALLBACK(on_deep_element_removed), metrics);
+    it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    while (gst_iterator_next(it, &item) == GST_ITERATOR_OK)
+    {
+        watch_element(metrics, g_value_get_object(&item));
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+
+    return metrics;
+}
+
+gint metrics_run(Metrics *metrics)
+{
+    GstBus *bus = gst_element_get_bus(metrics->pipeline);
+    guint report, interrupt;
+
+    metrics->loop = g_main_loop_new(NULL, FALSE);
+    metrics->result = -1;
+    metrics->start = g_get_monotonic_time();
+    gst_bus_add_watch(bus, on_bus_message, metrics);
+    report = g_timeout_add_seconds(METRICS_INTERVAL, on_report, metrics);
+    interrupt = g_unix_signal_add(SIGINT, on_interrupt, metrics);
+
+    g_main_loop_run(metrics->loop);
+
+    g_source_remove(interrupt);
+    g_source_remove(report);
+    gst_bus_remove_watch(bus);
+    gst_object_unref(bus);
+    g_main_loop_unref(metrics->loop);
+    metrics->loop = NULL;
+
+    return metrics->result;
+}
+
+void metrics_free(Metrics *metrics)
+{
+    guint i;
+
+    g_signal_handler_disconnect(metrics->pipeline, metrics->element_added);
+    g_signal_handler_disconnect(metrics->pipeline, metrics->element_removed);
+    for (i = 0; i < metrics->timings->len; i++)
+        unwatch_element(g_ptr_array_index(metrics->timings, i));
+    g_ptr_array_free(metrics->timings, TRUE);
+    g_hash_table_destroy(metrics->qos);
+    g_mutex_clear(&metrics->lock);
+    g_free(metrics);
+}
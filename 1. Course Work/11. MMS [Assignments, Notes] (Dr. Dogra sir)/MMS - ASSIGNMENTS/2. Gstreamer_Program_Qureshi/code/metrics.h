@@ -0,0 +1,22 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Bus handling and live metrics shared by sender.c & receiver.c
+
+#include <gst/gst.h>
+
+#define METRICS_INTERVAL 1 // Seconds between two metrics lines
+
+typedef struct _Metrics Metrics;
+
+// Start timing the elements of pipeline, call before it goes to PLAYING so elements added later are seen too
+Metrics *metrics_new(GstElement *pipeline, const gchar *app);
+
+// Run the main loop until an error, EOS or a second Ctrl-C (the first one sends EOS). Prints a JSON line of
+// metrics every METRICS_INTERVAL seconds. Returns 0 after EOS, -1 otherwise
+gint metrics_run(Metrics *metrics);
+
+// Call once metrics_run() has returned, takes its pad probes off the pipeline's elements again
+void metrics_free(Metrics *metrics);
+
+#endif /* METRICS_H */
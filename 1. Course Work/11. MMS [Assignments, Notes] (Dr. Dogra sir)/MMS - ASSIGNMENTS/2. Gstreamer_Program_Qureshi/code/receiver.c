@@ -1,98 +1,513 @@
 #include <gst/gst.h>
+#include <stdio.h>
+#include <string.h>
 #include "video_conferencing.h" // Include my header file (if needed further)
+#include "metrics.h"
 
-#define PORT "5000" // Change this to the receiver's port no.
+#define SENDER_IP_ADDRESS "192.168.0.1" // Change this to the sender's IP address (or pass the senders as arguments)
 #define WIDTH 640
 #define HEIGHT 480
+#define LATENCY 200    // Jitter buffer size in ms
+#define MAX_SENDERS 8  // Senders we send our reports to
+#define MAX_STREAMS 9  // Participants shown, in a grid of up to 3x3
+
+static gchar *group = NULL; // Multicast group to join, NULL for unicast
+static gboolean use_red = FALSE;
+static gboolean no_rtx = FALSE;
+
+static GOptionEntry entries[] = {
+    {"group", 'g', 0, G_OPTION_ARG_STRING, &group, "Receive from a multicast group instead of unicast", "ADDRESS"},
+    {"red", 'r', 0, G_OPTION_ARG_NONE, &use_red, "The senders wrap their packets in RED (sender --fec N --red)", NULL},
+    {"no-rtx", 0, 0, G_OPTION_ARG_NONE, &no_rtx, "Do not send NACKs for lost packets", NULL},
+    {NULL, 0, 0, 0, NULL, NULL, NULL}};
+
+// One participant, i.e. one SSRC in the session
+typedef struct
+{
+    guint ssrc;
+    gboolean used; // The slot is free again once the sender leaves or times out
+    GstElement *jitterbuffer;
+    GstElement *depayloader; // NULL until rtpbin has a pad for the stream
+    GstElement *decoder;
+    GstPad *mixer_pad; // Our tile in the compositor
+    gboolean active;   // Set while rtpbin's pad for the stream is linked
+} Stream;
+
+typedef struct
+{
+    GstElement *pipeline;
+    GstElement *mixer;
+    GMutex lock;
+    Stream streams[MAX_STREAMS];
+    guint n_streams;
+    GPtrArray *fecdecs; // rtpbin makes one FEC decoder per stream, we keep a ref so the totals survive the stream
+} Conference;
+
+// Look up the stream for ssrc, taking a free slot if it is new. Call with the lock held
+static Stream *find_stream(Conference *conf, guint ssrc)
+{
+    Stream *slot = NULL;
+    guint i;
+
+    for (i = 0; i < conf->n_streams; i++)
+    {
+        if (conf->streams[i].used && conf->streams[i].ssrc == ssrc)
+            return &conf->streams[i];
+        if (!conf->streams[i].used && !slot)
+            slot = &conf->streams[i];
+    }
+
+    if (!slot && conf->n_streams < MAX_STREAMS)
+        slot = &conf->streams[conf->n_streams++];
+    if (slot)
+    {
+        memset(slot, 0, sizeof(*slot));
+        slot->ssrc = ssrc;
+        slot->used = TRUE;
+    }
+
+    return slot;
+}
+
+// Tile the active streams into a grid that fills the window. Call with the lock held
+static void layout_grid(Conference *conf)
+{
+    guint i, k = 0, n = 0, cols = 1, rows;
+
+    for (i = 0; i < conf->n_streams; i++)
+        if (conf->streams[i].active && conf->streams[i].mixer_pad)
+            n++;
+    while (cols * cols < n)
+        cols++;
+    rows = n > 0 ? (n + cols - 1) / cols : 1;
+
+    for (i = 0; i < conf->n_streams; i++)
+    {
+        Stream *stream = &conf->streams[i];
+
+        if (!stream->mixer_pad)
+            continue;
+        if (!stream->active)
+        {
+            g_object_set(stream->mixer_pad, "alpha", 0.0, NULL);
+            continue;
+        }
+
+        g_object_set(stream->mixer_pad, "xpos", (gint)((k % cols) * WIDTH / cols), "ypos", (gint)((k / cols) * HEIGHT / rows),
+                     "width", (gint)(WIDTH / cols), "height", (gint)(HEIGHT / rows), "alpha", 1.0, NULL);
+        k++;
+    }
+}
+
+// Expose pad_name of element (inside bin) as ghost_name on the bin
+static void add_ghost_pad(GstElement *bin, GstElement *element, const gchar *pad_name, const gchar *ghost_name)
+{
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    gst_element_add_pad(bin, gst_ghost_pad_new(ghost_name, pad));
+    gst_object_unref(pad);
+}
+
+// Tell rtpbin about the payload types besides H264 that the sender may use
+static GstCaps *on_request_pt_map(GstElement *rtpbin, guint session_id, guint pt, gpointer user_data)
+{
+    (void)rtpbin;
+    (void)session_id;
+    (void)user_data;
+
+    switch (pt)
+    {
+    case H264_PT:
+        return gst_caps_from_string(RTP_CAPS);
+    case ULPFEC_PT:
+        return gst_caps_from_string("application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)ULPFEC");
+    case RED_PT:
+        return gst_caps_from_string("application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)RED");
+    default:
+        return NULL;
+    }
+}
+
+// rtpbin asks for this in front of the receive session: turn retransmissions and RED back into plain packets
+static GstElement *on_request_aux_receiver(GstElement *rtpbin, guint session_id, gpointer user_data)
+{
+    GstElement *bin, *first, *last, *rtx = NULL, *red = NULL;
+    GstStructure *pt_map;
+    gchar *name;
+
+    (void)rtpbin;
+    (void)user_data;
+
+    if (no_rtx && !use_red)
+        return NULL;
+
+    bin = gst_bin_new(NULL);
+    if (!no_rtx)
+    {
+        // Same map as the sender's: the payload type it sent as media (H264 or RED) -> the one it retransmits with
+        rtx = gst_element_factory_make("rtprtxreceive", NULL);
+        pt_map = gst_structure_new("application/x-rtp-pt-map", use_red ? G_STRINGIFY(RED_PT) : G_STRINGIFY(H264_PT), G_TYPE_UINT,
+                                   RTX_PT, NULL);
+        g_object_set(rtx, "payload-type-map", pt_map, NULL);
+        gst_structure_free(pt_map);
+        gst_bin_add(GST_BIN(bin), rtx);
+    }
+    if (use_red)
+    {
+        red = gst_element_factory_make("rtpreddec", NULL);
+        g_object_set(red, "pt", RED_PT, NULL);
+        gst_bin_add(GST_BIN(bin), red);
+    }
+    if (rtx && red)
+        gst_element_link(rtx, red);
+    first = rtx ? rtx : red;
+    last = red ? red : rtx;
+
+    name = g_strdup_printf("sink_%u", session_id);
+    add_ghost_pad(bin, first, "sink", name);
+    g_free(name);
+    name = g_strdup_printf("src_%u", session_id);
+    add_ghost_pad(bin, last, "src", name);
+    g_free(name);
+
+    return bin;
+}
+
+// rtpbin asks for this behind each jitter buffer, it rebuilds lost packets from the FEC packets kept in the session storage
+static GstElement *on_request_fec_decoder(GstElement *rtpbin, guint session_id, gpointer user_data)
+{
+    Conference *conf = user_data;
+    GstElement *storage, *fecdec;
+    GObject *internal_storage;
+
+    // Keep packets as long as the jitter buffer waits for them
+    g_signal_emit_by_name(rtpbin, "get-storage", session_id, &storage);
+    g_object_set(storage, "size-time", (guint64)LATENCY * GST_MSECOND, NULL);
+    gst_object_unref(storage);
+
+    g_signal_emit_by_name(rtpbin, "get-internal-storage", session_id, &internal_storage);
+    fecdec = gst_element_factory_make("rtpulpfecdec", NULL);
+    g_object_set(fecdec, "pt", ULPFEC_PT, "storage", internal_storage, NULL);
+    g_object_unref(internal_storage);
+
+    g_mutex_lock(&conf->lock);
+    g_ptr_array_add(conf->fecdecs, gst_object_ref(fecdec));
+    g_mutex_unlock(&conf->lock);
+
+    return fecdec;
+}
+
+static void on_new_jitterbuffer(GstElement *rtpbin, GstElement *jitterbuffer, guint session_id, guint ssrc, gpointer user_data)
+{
+    Conference *conf = user_data;
+    Stream *stream;
+
+    (void)rtpbin;
+    (void)session_id;
+
+    g_mutex_lock(&conf->lock);
+    stream = find_stream(conf, ssrc);
+    if (stream)
+        stream->jitterbuffer = jitterbuffer;
+    g_mutex_unlock(&conf->lock);
+}
+
+// Called by rtpbin whenever an RTCP packet arrives from a sender, print how much of its loss we got back
+static void on_ssrc_active(GstElement *rtpbin, guint session_id, guint ssrc, gpointer user_data)
+{
+    Conference *conf = user_data;
+    Stream *stream;
+    GstElement *jitterbuffer = NULL;
+    GstStructure *stats;
+    guint64 pushed = 0, lost = 0, late = 0, rtx_count = 0, rtx_success = 0, rtx_rtt = 0;
+    guint i, recovered = 0, unrecovered = 0;
+
+    (void)rtpbin;
+    (void)session_id;
+
+    g_mutex_lock(&conf->lock);
+    for (i = 0, stream = conf->streams; i < conf->n_streams; i++, stream++)
+        if (stream->used && stream->ssrc == ssrc && stream->jitterbuffer)
+            jitterbuffer = gst_object_ref(stream->jitterbuffer); // rtpbin drops it when the sender leaves
+    for (i = 0; i < conf->fecdecs->len; i++)
+    {
+        guint r, u;
+
+        g_object_get(g_ptr_array_index(conf->fecdecs, i), "recovered", &r, "unrecovered", &u, NULL);
+        recovered += r;
+        unrecovered += u;
+    }
+    g_mutex_unlock(&conf->lock);
+
+    if (!jitterbuffer)
+        return;
+
+    g_object_get(jitterbuffer, "stats", &stats, NULL);
+    gst_structure_get_uint64(stats, "num-pushed", &pushed);
+    gst_structure_get_uint64(stats, "num-lost", &lost);
+    gst_structure_get_uint64(stats, "num-late", &late);
+    gst_structure_get_uint64(stats, "rtx-count", &rtx_count);
+    gst_structure_get_uint64(stats, "rtx-success-count", &rtx_success);
+    gst_structure_get_uint64(stats, "rtx-rtt", &rtx_rtt);
+    gst_structure_free(stats);
+    gst_object_unref(jitterbuffer);
+
+    g_print("Recovery for %08x: %" G_GUINT64_FORMAT " pushed, %" G_GUINT64_FORMAT " lost, %" G_GUINT64_FORMAT " late, "
+            "RTX %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " requests answered (RTT %" G_GUINT64_FORMAT " ms), "
+            "FEC %u recovered / %u not (all streams)\n",
+            ssrc, pushed, lost, late, rtx_success, rtx_count, rtx_rtt / GST_MSECOND, recovered, unrecovered);
+}
+
+// rtpbin creates a pad per sender (SSRC) once its first packet arrives, give it a decoder and a tile in the grid
+static void on_pad_added(GstElement *rtpbin, GstPad *pad, gpointer user_data)
+{
+    Conference *conf = user_data;
+    GstPad *sinkpad, *srcpad;
+    Stream *stream;
+    gchar *name = gst_pad_get_name(pad);
+    guint session_id, ssrc, pt;
+    gboolean linked = FALSE;
+
+    (void)rtpbin;
+
+    if (sscanf(name, "recv_rtp_src_%u_%u_%u", &session_id, &ssrc, &pt) != 3)
+    {
+        g_free(name);
+        return;
+    }
+
+    g_mutex_lock(&conf->lock);
+    stream = find_stream(conf, ssrc);
+    if (!stream)
+    {
+        g_printerr("No room for another participant, ignoring %s.\n", name);
+        g_mutex_unlock(&conf->lock);
+        g_free(name);
+        return;
+    }
+
+    // A sender that comes back before its old pad went away keeps its decoder and tile
+    if (!stream->depayloader)
+    {
+        // Each participant is decoded on its own jitter buffer thread, so decoding spreads over the cores
+        stream->depayloader = gst_element_factory_make("rtph264depay", NULL);
+        stream->decoder = gst_element_factory_make("avdec_h264", NULL);
+        gst_bin_add_many(GST_BIN(conf->pipeline), stream->depayloader, stream->decoder, NULL);
+        gst_element_link(stream->depayloader, stream->decoder);
+
+        // Ask the sender for a keyframe (PLI) after a loss instead of showing corrupt frames until the next one
+        if (g_object_class_find_property(G_OBJECT_GET_CLASS(stream->depayloader), "request-keyframe"))
+            g_object_set(stream->depayloader, "request-keyframe", TRUE, "wait-for-keyframe", TRUE, NULL);
+
+        stream->mixer_pad = gst_element_request_pad_simple(conf->mixer, "sink_%u");
+        srcpad = gst_element_get_static_pad(stream->decoder, "src");
+        gst_pad_link(srcpad, stream->mixer_pad);
+        gst_object_unref(srcpad);
+
+        gst_element_sync_state_with_parent(stream->decoder);
+        gst_element_sync_state_with_parent(stream->depayloader);
+    }
+
+    sinkpad = gst_element_get_static_pad(stream->depayloader, "sink");
+    if (gst_pad_is_linked(sinkpad))
+        g_printerr("Participant %08x already has a stream, ignoring %s.\n", ssrc, name);
+    else if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)
+        g_printerr("Could not link %s to its depayloader.\n", name);
+    else
+        linked = TRUE;
+    gst_object_unref(sinkpad);
+
+    if (linked)
+    {
+        stream->active = TRUE;
+        layout_grid(conf);
+    }
+    g_mutex_unlock(&conf->lock);
+
+    if (linked)
+        g_print("Participant %08x joined.\n", ssrc);
+    g_free(name);
+}
+
+// The sender said BYE or timed out: take its decoder out, give its tile to the others and free its slot
+static void on_pad_removed(GstElement *rtpbin, GstPad *pad, gpointer user_data)
+{
+    Conference *conf = user_data;
+    GstElement *depayloader = NULL, *decoder = NULL;
+    GstPad *mixer_pad = NULL;
+    gchar *name = gst_pad_get_name(pad);
+    guint session_id, ssrc, pt, i;
+
+    (void)rtpbin;
+
+    if (sscanf(name, "recv_rtp_src_%u_%u_%u", &session_id, &ssrc, &pt) != 3)
+    {
+        g_free(name);
+        return;
+    }
+
+    g_mutex_lock(&conf->lock);
+    for (i = 0; i < conf->n_streams; i++)
+    {
+        Stream *stream = &conf->streams[i];
+
+        if (!stream->used || stream->ssrc != ssrc)
+            continue;
+        depayloader = stream->depayloader;
+        decoder = stream->decoder;
+        mixer_pad = stream->mixer_pad;
+        memset(stream, 0, sizeof(*stream));
+    }
+    layout_grid(conf);
+    g_mutex_unlock(&conf->lock);
+
+    // rtpbin has already stopped the stream's jitter buffer, so nothing flows through these any more
+    if (depayloader)
+    {
+        gst_element_set_state(decoder, GST_STATE_NULL);
+        gst_element_set_state(depayloader, GST_STATE_NULL);
+        gst_bin_remove_many(GST_BIN(conf->pipeline), depayloader, decoder, NULL);
+    }
+    if (mixer_pad)
+    {
+        gst_element_release_request_pad(conf->mixer, mixer_pad);
+        gst_object_unref(mixer_pad);
+    }
+
+    g_print("Participant %08x left.\n", ssrc);
+    g_free(name);
+}
 
 int main(int argc, char *argv[])
 {
-    GstElement *pipeline, *source, *depayloader, *decoder, *filter, *sink;
+    GstElement *pipeline, *source, *rtcpsrc, *rtpbin, *rtcpsink, *mixer, *filter, *converter, *sink;
     GstCaps *caps;
-    GstBus *bus;
-    GstMessage *msg;
     GstStateChangeReturn ret;
+    GObject *session;
+    Metrics *metrics;
+    Conference conf = {0};
+    GOptionContext *context;
+    GError *error = NULL;
+    gint i, result;
 
-    // Initialize GStreamer
-    gst_init(&argc, &argv);
+    // Initialize GStreamer, together with our own options
+    context = g_option_context_new("[SENDER_IP...]");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("Could not parse the options: %s\n", error->message);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(context);
 
     // Create the elements
     source = gst_element_factory_make("udpsrc", "source");
-    depayloader = gst_element_factory_make("rtph264depay", "depayloader");
-    decoder = gst_element_factory_make("avdec_h264", "decoder");
+    rtcpsrc = gst_element_factory_make("udpsrc", "rtcpsrc");
+    rtpbin = gst_element_factory_make("rtpbin", "rtpbin");
+    rtcpsink = gst_element_factory_make("multiudpsink", "rtcpsink");
+    mixer = gst_element_factory_make("compositor", "mixer");
     filter = gst_element_factory_make("capsfilter", "filter");
+    converter = gst_element_factory_make("videoconvert", "converter");
     sink = gst_element_factory_make("xvimagesink", "sink"); // Use xvimagesink for X11 display
 
     // Create the pipeline
     pipeline = gst_pipeline_new("video-conference-receiver");
 
-    if (!pipeline || !source || !depayloader || !decoder || !filter || !sink)
+    if (!pipeline || !source || !rtcpsrc || !rtpbin || !rtcpsink || !mixer || !filter || !converter || !sink)
     {
         g_printerr("One or more elements could not be created. Exiting.\n");
         return -1;
     }
 
-    // Set source properties
-    g_object_set(source, "port", PORT, NULL);
+    // Set source properties, every sender streams to the same port and is told apart by its SSRC
+    caps = gst_caps_from_string(RTP_CAPS);
+    g_object_set(source, "port", RTP_PORT, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    g_object_set(rtcpsrc, "port", RTCP_SR_PORT, NULL);
+    if (group)
+    {
+        g_object_set(source, "address", group, NULL);
+        g_object_set(rtcpsrc, "address", group, NULL);
+    }
+
+    // NACKs go out as soon as a gap is seen (AVPF), the jitter buffer only asks while a retransmission can still make it
+    g_object_set(rtpbin, "latency", LATENCY, "do-retransmission", !no_rtx, NULL);
+    gst_util_set_object_arg(G_OBJECT(rtpbin), "rtp-profile", "avpf");
 
-    // Set filter properties
-    g_object_set(filter, "caps", gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, WIDTH, "height", G_TYPE_INT, HEIGHT, NULL), NULL);
+    // Our receiver reports (loss, jitter, RTT) go back to every sender
+    g_object_set(rtcpsink, "sync", FALSE, "async", FALSE, NULL);
+    for (i = 1; i < argc && i <= MAX_SENDERS; i++)
+        g_signal_emit_by_name(rtcpsink, "add", argv[i], RTCP_RR_PORT);
+    if (argc > MAX_SENDERS + 1)
+        g_printerr("Only sending reports to the first %d senders.\n", MAX_SENDERS);
+    if (argc == 1)
+        g_signal_emit_by_name(rtcpsink, "add", SENDER_IP_ADDRESS, RTCP_RR_PORT);
+
+    // Set filter properties, the compositor scales every participant into its tile
+    caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, WIDTH, "height", G_TYPE_INT, HEIGHT, NULL);
+    g_object_set(filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(mixer), "ignore-inactive-pads"))
+        g_object_set(mixer, "ignore-inactive-pads", TRUE, NULL); // Do not wait for a participant whose stream stalls
+
+    // Loss recovery elements are handed to rtpbin when it creates the session and streams
+    conf.pipeline = pipeline;
+    conf.mixer = mixer;
+    g_mutex_init(&conf.lock);
+    conf.fecdecs = g_ptr_array_new_with_free_func(gst_object_unref);
+    g_signal_connect(rtpbin, "request-pt-map", G_CALLBACK(on_request_pt_map), NULL);
+    g_signal_connect(rtpbin, "request-aux-receiver", G_CALLBACK(on_request_aux_receiver), NULL);
+    g_signal_connect(rtpbin, "request-fec-decoder", G_CALLBACK(on_request_fec_decoder), &conf);
+    g_signal_connect(rtpbin, "new-jitterbuffer", G_CALLBACK(on_new_jitterbuffer), &conf);
+    g_signal_connect(rtpbin, "on-ssrc-active", G_CALLBACK(on_ssrc_active), &conf);
 
     // Add elements to the pipeline
-    gst_bin_add_many(GST_BIN(pipeline), source, depayloader, decoder, filter, sink, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), source, rtcpsrc, rtpbin, rtcpsink, mixer, filter, converter, sink, NULL);
 
-    // Link elements
-    if (!gst_element_link_many(source, depayloader, decoder, filter, sink, NULL))
+    // Link elements, the participants are linked between rtpbin and the mixer in on_pad_added()
+    if (!gst_element_link_pads(source, "src", rtpbin, "recv_rtp_sink_0") ||
+        !gst_element_link_pads(rtcpsrc, "src", rtpbin, "recv_rtcp_sink_0") ||
+        !gst_element_link_pads(rtpbin, "send_rtcp_src_0", rtcpsink, "sink") ||
+        !gst_element_link_many(mixer, filter, converter, sink, NULL))
     {
         g_printerr("Elements could not be linked. Exiting.\n");
         gst_object_unref(pipeline);
         return -1;
     }
+    g_signal_connect(rtpbin, "pad-added", G_CALLBACK(on_pad_added), &conf);
+    g_signal_connect(rtpbin, "pad-removed", G_CALLBACK(on_pad_removed), &conf);
+
+    // Report back to the senders often enough for their bitrate control to keep up
+    g_signal_emit_by_name(rtpbin, "get-internal-session", 0, &session);
+    g_object_set(session, "rtcp-min-interval", (guint64)RTCP_MIN_INTERVAL, NULL);
+    g_object_unref(session);
+
+    // Time every element with a single input and output, the decoders added per participant included
+    metrics = metrics_new(pipeline, "receiver");
 
     // Set the pipeline to the playing state
     ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE)
     {
         g_printerr("Unable to set the pipeline to the playing state. Exiting.\n");
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        metrics_free(metrics);
         gst_object_unref(pipeline);
         return -1;
     }
 
-    // Wait until error or EOS
-    bus = gst_element_get_bus(pipeline);
-    msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
-
-    // Parse message
-    if (msg != NULL)
-    {
-        GError *err;
-        gchar *debug_info;
-
-        switch (GST_MESSAGE_TYPE(msg))
-        {
-        case GST_MESSAGE_ERROR:
-            gst_message_parse_error(msg, &err, &debug_info);
-            g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
-            g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
-            g_clear_error(&err);
-            g_free(debug_info);
-            break;
-        case GST_MESSAGE_EOS:
-            g_print("End-Of-Stream reached.\n");
-            break;
-        default:
-            // Should not be reached
-            g_printerr("Unexpected message received.\n");
-            break;
-        }
-
-        gst_message_unref(msg);
-    }
+    // Handle bus messages and print the metrics until error or EOS
+    result = metrics_run(metrics);
 
     // Free resources
-    gst_object_unref(bus);
     gst_element_set_state(pipeline, GST_STATE_NULL);
+    metrics_free(metrics);
     gst_object_unref(pipeline);
+    g_ptr_array_free(conf.fecdecs, TRUE);
+    g_mutex_clear(&conf.lock);
+    g_free(group);
 
-    return 0;
+    return result;
 }
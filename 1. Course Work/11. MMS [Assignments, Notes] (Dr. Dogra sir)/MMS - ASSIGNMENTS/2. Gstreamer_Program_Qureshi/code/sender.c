@@ -1,100 +1,929 @@
+#define _GNU_SOURCE // For pthread_setaffinity_np()
 #include <gst/gst.h>
+#include <gst/video/video.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include "video_conferencing.h" // Include my header file (if needed further)
+#include "metrics.h"
 
 #define WIDTH 640
 #define HEIGHT 480
-#define PORT "5000"              // Change this to the receiver's port no.
-#define IP_ADDRESS "192.168.0.2" // Change this to the receiver's IP address
+#define IP_ADDRESS "192.168.0.2" // Change this to the receiver's IP address (or pass the peers as arguments)
+#define MAX_PEERS 8              // Receivers (or multicast groups) we fan out to
+#define PEER_QUEUE_MS 200        // A peer that falls this far behind loses frames instead of holding up the others
+#define MAX_LAYERS 3             // Simulcast layers, see layer_specs
+#define MAX_REPORTERS 16         // Receivers per peer (members of a multicast group) we keep report state for
+
+// Bitrate control (kbit/s), driven by the receivers' RTCP reports
+#define START_BITRATE 1024
+#define MIN_BITRATE 128
+#define MAX_BITRATE 2048
+#define LOSS_HIGH 0.10      // Back off above 10% loss
+#define LOSS_LOW 0.02       // Probe for more bandwidth below 2% loss
+#define RTT_SLACK_MS 100    // RTT this far above the lowest seen means queues are building up
+#define MIN_STEP_MS 500     // Regular reports come every 0.5-1.5 RTCP_MIN_INTERVAL, anything sooner is early feedback
+#define REPORTER_TIMEOUT_MS 10000 // A receiver that has not reported for this long has left the group
+#define ADAPT_RESOLUTION 1  // Set to 0 to only adapt the bitrate (single layer only)
+#define LOW_RES_BITRATE 384 // Switch to half resolution below this bitrate (single layer only)
+
+// Capture
+#define CAPTURE_FORMATS "NV12, I420, YV12, Y42B, Y444" // What x264enc takes as is, so camera frames need no videoconvert
+#define TAP_FRAMES 4                                   // The shared memory area holds this many frames for local consumers
+
+// Loss recovery
+#define MAX_FEC_PERCENTAGE 50 // Upper bound when FEC has to stand in for retransmissions
+#define RTX_MAX_RTT_MS 100    // Above this RTT a retransmission misses the receiver's 200ms jitter buffer
+
+/*
+ * To try it out under a bandwidth limit on one machine:
+ *   sudo tc qdisc add dev lo root netem rate 1mbit delay 20ms loss 2%
+ *   ./receiver 127.0.0.1 & ./sender --fec 20 127.0.0.1
+ *   sudo tc qdisc change dev lo root netem delay 20ms loss 5%   (loss only, the receiver prints what FEC and RTX recovered)
+ *   sudo tc qdisc del dev lo root
+ *
+ * For a conference every participant runs a sender with all the others as peers
+ * (./sender 192.168.0.2 192.168.0.3) and a receiver with the same list, or everybody
+ * uses one multicast group (./sender 239.1.1.1, ./receiver --group 239.1.1.1 ...).
+ *
+ * With simulcast (the default) the camera is encoded once per layer and every peer is
+ * switched, on a keyframe, to the best layer its reports allow. With --layers 1 there is
+ * a single encoder whose bitrate and resolution follow the slowest peer instead.
+ * The layer is picked here, not by the receiver: every peer gets one SSRC that changes
+ * resolution on a keyframe. Sending each layer on its own SSRC for the receiver to choose
+ * from would put all layers on every link, as there is no server in between to drop the
+ * unused ones, and the receiver has no way to tell us which one it wants.
+ *
+ * The raw camera frames can be shared with other programs on this machine (recording,
+ * analytics) without opening the camera twice. ./sender --tap /tmp/camera prints the caps
+ * of the frames once they flow, a consumer then reads them with e.g.
+ *   gst-launch-1.0 shmsrc socket-path=/tmp/camera is-live=true ! video/x-raw,format=NV12,width=640,height=480,framerate=30/1 ! videoconvert ! autovideosink
+ * Without a camera, --test-source captures from videotestsrc instead.
+ *
+ * Both programs print a JSON line of metrics every second (latency, QoS drops, time spent per
+ * element with the hottest first), e.g. ./sender 127.0.0.1 | grep '^{' > sender.jsonl
+ */
+
+// Simulcast layers, best first. Layer 0 is also the single layer's starting point
+typedef struct
+{
+    gint width;
+    gint height;
+    guint bitrate; // kbit/s
+} LayerSpec;
+
+static const LayerSpec layer_specs[MAX_LAYERS] = {{WIDTH, HEIGHT, START_BITRATE}, {WIDTH / 2, HEIGHT / 2, 384}, {WIDTH / 4, HEIGHT / 4, 128}};
+
+static gint n_layers = MAX_LAYERS;
+static gint fec_percentage = 0; // 0 disables FEC
+static gboolean use_red = FALSE;
+static gboolean no_rtx = FALSE;
+static gchar *io_mode = NULL; // v4l2src io-mode, mmap by default
+static gboolean test_source = FALSE;
+static gchar *tap_path = NULL;
+static gboolean analytics = FALSE;
+
+static GOptionEntry entries[] = {
+    {"layers", 'l', 0, G_OPTION_ARG_INT, &n_layers, "Number of simulcast layers (1-3)", "N"},
+    {"fec", 'f', 0, G_OPTION_ARG_INT, &fec_percentage, "ULPFEC overhead in percent of the media packets (0 = off)", "PERCENT"},
+    {"red", 'r', 0, G_OPTION_ARG_NONE, &use_red, "Wrap media and FEC packets in RED (needs --fec)", NULL},
+    {"no-rtx", 0, 0, G_OPTION_ARG_NONE, &no_rtx, "Do not answer NACKs with retransmissions", NULL},
+    {"io-mode", 0, 0, G_OPTION_ARG_STRING, &io_mode, "How the camera hands over frames (mmap or dmabuf)", "MODE"},
+    {"test-source", 0, 0, G_OPTION_ARG_NONE, &test_source, "Capture from videotestsrc instead of the camera", NULL},
+    {"tap", 't', 0, G_OPTION_ARG_FILENAME, &tap_path, "Share the raw camera frames through shared memory at this socket", "PATH"},
+    {"analytics", 'a', 0, G_OPTION_ARG_NONE, &analytics, "Print the mean brightness of the raw frames once a second", NULL},
+    {NULL, 0, 0, 0, NULL, NULL, NULL}};
+
+// One receiver reporting about a peer's stream. A unicast peer has one, a multicast group one per member
+typedef struct
+{
+    gboolean used;
+    guint ssrc;       // The receiver's own SSRC, the one its RTCP packets come from
+    guint bitrate;    // kbit/s this receiver can take, media and FEC together
+    guint fec;        // FEC overhead in percent its loss and RTT call for
+    guint min_rtt_ms; // Lowest RTT seen, our estimate of its uncongested path
+    gint64 last_step; // g_get_monotonic_time() of its last control step
+} Reporter;
+
+// One receiver (or multicast group), each gets its own rtpbin session so its reports and recovery are its own
+typedef struct
+{
+    guint index; // Also the rtpbin session id
+    const gchar *host;
+    GstElement *selector;           // Picks the layer this peer gets
+    GstPad *layer_pads[MAX_LAYERS]; // Selector input per layer
+    gint layer;                     // Layer currently sent (atomic)
+    gint pending_layer;             // Layer to switch to on its next keyframe, -1 for none (atomic)
+    GstElement *payloader;
+    GstElement *fecenc; // NULL when FEC is off
+    guint bitrate;      // kbit/s the peer can take, media and FEC together (its slowest receiver's)
+    guint fec;          // FEC overhead in percent currently set on fecenc (what its lossiest receiver needs)
+    Reporter reporters[MAX_REPORTERS];
+} Peer;
+
+// One encoder, fed from the camera through its own queue whose thread runs the encoder
+typedef struct
+{
+    GstElement *queue;
+    GstElement *scalefilter;
+    GstElement *encoder;
+    GstElement *tee;
+    guint first_cpu; // The queue thread (and so x264's threads) is pinned to n_cpus cores from here
+    guint n_cpus;
+} Layer;
+
+typedef struct
+{
+    Layer layers[MAX_LAYERS];
+    guint n_layers;
+    GMutex lock;
+    guint bitrate; // kbit/s currently set on the encoder, single layer only
+    gboolean low_res;
+    Peer peers[MAX_PEERS];
+    guint n_peers;
+} RateControl;
+
+// Create an element named prefix_index, to tell the per peer copies apart
+static GstElement *make_element(const gchar *factory, const gchar *prefix, guint index)
+{
+    gchar *name = g_strdup_printf("%s_%u", prefix, index);
+    GstElement *element = gst_element_factory_make(factory, name);
+
+    g_free(name);
+    return element;
+}
+
+// gst_element_link_pads() for rtpbin pads, which carry the session id in their name ("send_rtp_sink_%u")
+static gboolean link_session(GstElement *src, const gchar *src_pad, GstElement *sink, const gchar *sink_pad, guint session_id)
+{
+    gchar *src_name = g_strdup_printf(src_pad, session_id);
+    gchar *sink_name = g_strdup_printf(sink_pad, session_id);
+    gboolean linked = gst_element_link_pads(src, src_name, sink, sink_name);
+
+    g_free(src_name);
+    g_free(sink_name);
+    return linked;
+}
+
+// Set the encoder resolution (the scaler sits between the camera and the encoder)
+static void set_resolution(RateControl *rc, gint width, gint height)
+{
+    GstCaps *caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+
+    g_object_set(rc->layers[0].scalefilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+}
+
+// Expose pad_name of element (inside bin) as ghost_name on the bin
+static void add_ghost_pad(GstElement *bin, GstElement *element, const gchar *pad_name, const gchar *ghost_name)
+{
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    gst_element_add_pad(bin, gst_ghost_pad_new(ghost_name, pad));
+    gst_object_unref(pad);
+}
+
+// rtpbin asks for this when it sets up a send session, it sits in front of the session
+static GstElement *on_request_fec_encoder(GstElement *rtpbin, guint session_id, gpointer user_data)
+{
+    RateControl *rc = user_data;
+    Peer *peer = &rc->peers[session_id];
+    GstElement *bin, *red;
+
+    (void)rtpbin;
+
+    if (fec_percentage <= 0)
+        return NULL;
+
+    // Keyframes are what the receiver waits for after a loss, so they get twice the protection
+    peer->fec = fec_percentage;
+    peer->fecenc = make_element("rtpulpfecenc", "fecenc", session_id);
+    g_object_set(peer->fecenc, "pt", ULPFEC_PT, "percentage", peer->fec, "percentage-important", MIN(peer->fec * 2, 100),
+                 NULL);
+    if (!use_red)
+        return peer->fecenc;
+
+    // RED carries media and FEC under a single payload type
+    bin = gst_bin_new(NULL);
+    red = make_element("rtpredenc", "redenc", session_id);
+    g_object_set(red, "pt", RED_PT, "allow-no-red-blocks", TRUE, NULL);
+    gst_bin_add_many(GST_BIN(bin), peer->fecenc, red, NULL);
+    gst_element_link(peer->fecenc, red);
+    add_ghost_pad(bin, peer->fecenc, "sink", "sink");
+    add_ghost_pad(bin, red, "src", "src");
+
+    return bin;
+}
+
+// rtpbin asks for this after a send session, it keeps a history of sent packets to answer NACKs from
+static GstElement *on_request_aux_sender(GstElement *rtpbin, guint session_id, gpointer user_data)
+{
+    GstElement *bin, *rtx;
+    GstStructure *pt_map;
+    gchar *name;
+
+    (void)rtpbin;
+    (void)user_data;
+
+    if (no_rtx)
+        return NULL;
+
+    // Media packets leave the session as RED when the FEC encoder wraps them
+    bin = gst_bin_new(NULL);
+    rtx = make_element("rtprtxsend", "rtxsend", session_id);
+    pt_map = gst_structure_new("application/x-rtp-pt-map", use_red ? G_STRINGIFY(RED_PT) : G_STRINGIFY(H264_PT),
+                               G_TYPE_UINT, RTX_PT, NULL);
+    g_object_set(rtx, "payload-type-map", pt_map, "max-size-time", RTX_HISTORY, NULL);
+    gst_structure_free(pt_map);
+    gst_bin_add(GST_BIN(bin), rtx);
+
+    name = g_strdup_printf("sink_%u", session_id);
+    add_ghost_pad(bin, rtx, "sink", name);
+    g_free(name);
+    name = g_strdup_printf("src_%u", session_id);
+    add_ghost_pad(bin, rtx, "src", name);
+    g_free(name);
+
+    return bin;
+}
+
+// Single layer: the encoder is shared, so it runs at what the slowest peer can take (minus that peer's FEC overhead)
+static void update_encoder(RateControl *rc)
+{
+    guint i, bitrate = MAX_BITRATE;
+
+    for (i = 0; i < rc->n_peers; i++)
+        bitrate = MIN(bitrate, rc->peers[i].bitrate * 100 / (100 + rc->peers[i].fec));
+
+    if (bitrate != rc->bitrate)
+    {
+        rc->bitrate = bitrate;
+        g_object_set(rc->layers[0].encoder, "bitrate", bitrate, NULL);
+    }
+
+    // Resolution steps have hysteresis so we do not flip back and forth around the threshold
+    if (ADAPT_RESOLUTION && !rc->low_res && bitrate < LOW_RES_BITRATE)
+    {
+        rc->low_res = TRUE;
+        set_resolution(rc, WIDTH / 2, HEIGHT / 2);
+    }
+    else if (ADAPT_RESOLUTION && rc->low_res && bitrate > LOW_RES_BITRATE * 3 / 2)
+    {
+        rc->low_res = FALSE;
+        set_resolution(rc, WIDTH, HEIGHT);
+    }
+}
+
+// Simulcast: the encoders keep their rates and the peer moves to the best layer its bitrate (plus FEC) allows
+static void select_layer(RateControl *rc, Peer *peer)
+{
+    guint layer, need;
+    gint current = g_atomic_int_get(&peer->layer);
+
+    for (layer = 0; layer < rc->n_layers - 1; layer++)
+    {
+        // The encoders leave room for the --fec overhead in the layer's bitrate, the peer may need more than that
+        need = layer_specs[layer].bitrate * (100 + peer->fec) / (100 + fec_percentage);
+        if ((gint)layer < current)
+            need = need * 6 / 5; // Moving up needs some headroom, or we would flap between two layers
+        if (peer->bitrate >= need)
+            break;
+    }
+
+    if ((gint)layer == current || (gint)layer == g_atomic_int_get(&peer->pending_layer))
+        return;
+
+    // The switch itself happens in on_layer_buffer() on the new layer's next keyframe, so ask for one now
+    g_atomic_int_set(&peer->pending_layer, layer);
+    gst_element_send_event(rc->layers[layer].encoder, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+// Buffer probe on each selector input, switches the peer to its pending layer once a keyframe of that layer comes by
+static GstPadProbeReturn on_layer_buffer(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Peer *peer = user_data;
+    gint pending = g_atomic_int_get(&peer->pending_layer);
+
+    if (pending < 0 || peer->layer_pads[pending] != pad ||
+        GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_OK;
+
+    // The payloader stays the same, so the receiver sees one SSRC that changes resolution on a keyframe
+    g_object_set(peer->selector, "active-pad", pad, NULL);
+    g_atomic_int_set(&peer->layer, pending);
+    g_atomic_int_compare_and_exchange(&peer->pending_layer, pending, -1);
+    g_print("%s switched to %dx%d\n", peer->host, layer_specs[pending].width, layer_specs[pending].height);
+
+    return GST_PAD_PROBE_OK;
+}
+
+// Report state for the receiver with this SSRC, a new receiver takes a free slot (or that of the one heard from least
+// recently) and starts from what the peer is being sent
+static Reporter *find_reporter(Peer *peer, guint ssrc)
+{
+    Reporter *reporter, *slot = NULL;
+    guint i;
+
+    for (i = 0; i < MAX_REPORTERS; i++)
+    {
+        reporter = &peer->reporters[i];
+        if (reporter->used && reporter->ssrc == ssrc)
+            return reporter;
+        if (!slot || (slot->used && (!reporter->used || reporter->last_step < slot->last_step)))
+            slot = reporter;
+    }
+
+    slot->used = TRUE;
+    slot->ssrc = ssrc;
+    slot->bitrate = peer->bitrate;
+    slot->fec = peer->fec;
+    slot->min_rtt_ms = 0;
+    slot->last_step = 0;
+    return slot;
+}
+
+// A peer can only be sent one stream, so it gets what its worst receiver can take: the lowest bitrate and the most FEC.
+// Receivers that stopped reporting (left the group) are forgotten, or they would hold the others back
+static void worst_reporter(Peer *peer, gint64 now, guint *bitrate, guint *fec)
+{
+    Reporter *reporter;
+    guint i;
+
+    *bitrate = MAX_BITRATE;
+    *fec = 0;
+    for (i = 0; i < MAX_REPORTERS; i++)
+    {
+        reporter = &peer->reporters[i];
+        if (reporter->used && now - reporter->last_step > REPORTER_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND)
+            reporter->used = FALSE;
+        if (!reporter->used)
+            continue;
+        *bitrate = MIN(*bitrate, reporter->bitrate);
+        *fec = MAX(*fec, reporter->fec);
+    }
+}
+
+// Called by rtpbin whenever an RTCP packet arrives from a receiver, runs one step of the control loop for that receiver
+static void on_ssrc_active(GstElement *rtpbin, guint session_id, guint ssrc, gpointer user_data)
+{
+    RateControl *rc = user_data;
+    Peer *peer = &rc->peers[session_id];
+    Reporter *reporter;
+    GObject *session, *source = NULL;
+    GstStructure *stats;
+    guint own_ssrc = 0, rb_ssrc = 0, fraction_lost = 0, jitter = 0, round_trip = 0, rtt_ms, bitrate, fec, peer_bitrate,
+          peer_fec;
+    gboolean have_rb = FALSE;
+    gdouble loss;
+    gint64 now;
+
+    g_object_get(peer->payloader, "stats", &stats, NULL);
+    gst_structure_get_uint(stats, "ssrc", &own_ssrc);
+    gst_structure_free(stats);
+
+    // ssrc is the receiver that sent the RTCP packet, its source keeps the last report block it sent about us
+    g_signal_emit_by_name(rtpbin, "get-internal-session", session_id, &session);
+    g_signal_emit_by_name(session, "get-source-by-ssrc", ssrc, &source);
+    g_object_unref(session);
+    if (!source)
+        return;
+
+    g_object_get(source, "stats", &stats, NULL);
+    g_object_unref(source);
+    if (gst_structure_get_boolean(stats, "have-rb", &have_rb) && have_rb)
+    {
+        gst_structure_get_uint(stats, "rb-ssrc", &rb_ssrc);
+        gst_structure_get_uint(stats, "rb-fractionlost", &fraction_lost);
+        gst_structure_get_uint(stats, "rb-jitter", &jitter);
+        gst_structure_get_uint(stats, "rb-round-trip", &round_trip);
+    }
+    gst_structure_free(stats);
+
+    // Every session hears every report on RTCP_RR_PORT. Only act on the receivers reporting about this peer's
+    // stream, whether or not anything got through to them (100% loss is the case that matters most)
+    if (!have_rb || rb_ssrc != own_ssrc)
+        return;
+
+    // With AVPF every NACK and PLI goes out as an early RTCP packet with a report in it. Step once per report
+    // interval only, or a burst of NACKs would cut the rate several times over on a few milliseconds of loss.
+    // In a multicast group every member reports about the same stream, so each one is stepped on its own
+    now = g_get_monotonic_time();
+    reporter = find_reporter(peer, ssrc);
+    if (reporter->last_step != 0 && now - reporter->last_step < MIN_STEP_MS * G_TIME_SPAN_MILLISECOND)
+        return;
+    reporter->last_step = now;
+
+    // Fraction lost is 8 bit fixed point, jitter is in 90kHz clock units and RTT is 16.16 fixed point seconds
+    loss = fraction_lost / 256.0;
+    rtt_ms = (guint)(((guint64)round_trip * 1000) >> 16);
+    if (rtt_ms > 0 && (reporter->min_rtt_ms == 0 || rtt_ms < reporter->min_rtt_ms))
+        reporter->min_rtt_ms = rtt_ms;
+
+    if (loss > LOSS_HIGH)
+        bitrate = reporter->bitrate * (1.0 - loss / 2); // Decrease in proportion to the loss
+    else if (reporter->min_rtt_ms > 0 && rtt_ms > reporter->min_rtt_ms + RTT_SLACK_MS)
+        bitrate = reporter->bitrate * 0.85; // Queues are growing, back off before they start dropping
+    else if (loss < LOSS_LOW)
+        bitrate = reporter->bitrate * 1.05; // Slowly probe for spare bandwidth
+    else
+        bitrate = reporter->bitrate;
+    bitrate = CLAMP(bitrate, MIN_BITRATE, MAX_BITRATE);
+
+    // Retransmissions cannot arrive in time on a long RTT, so let FEC cover twice the loss instead
+    fec = peer->fecenc ? (guint)fec_percentage : 0;
+    if (peer->fecenc && (no_rtx || rtt_ms > RTX_MAX_RTT_MS))
+        fec = MAX(fec, MIN((guint)(loss * 200), MAX_FEC_PERCENTAGE));
+
+    reporter->bitrate = bitrate;
+    reporter->fec = fec;
+    worst_reporter(peer, now, &peer_bitrate, &peer_fec);
+    if (peer_fec != peer->fec)
+        g_object_set(peer->fecenc, "percentage", peer_fec, "percentage-important", MIN(peer_fec * 2, 100), NULL);
+
+    g_mutex_lock(&rc->lock);
+    peer->bitrate = peer_bitrate;
+    peer->fec = peer_fec;
+    if (rc->n_layers > 1)
+    {
+        select_layer(rc, peer);
+        g_print("RTCP from %s (%08x): loss %.1f%%, jitter %u ms, RTT %u ms -> %u kbit/s, peer %u kbit/s (FEC %u%%), layer %d\n",
+                peer->host, ssrc, loss * 100, jitter / 90, rtt_ms, bitrate, peer_bitrate, peer_fec,
+                g_atomic_int_get(&peer->layer));
+    }
+    else
+    {
+        update_encoder(rc);
+        g_print("RTCP from %s (%08x): loss %.1f%%, jitter %u ms, RTT %u ms -> %u kbit/s, peer %u kbit/s (FEC %u%%), encoder %u "
+                "kbit/s at %dx%d\n",
+                peer->host, ssrc, loss * 100, jitter / 90, rtt_ms, bitrate, peer_bitrate, peer_fec, rc->bitrate,
+                rc->low_res ? WIDTH / 2 : WIDTH, rc->low_res ? HEIGHT / 2 : HEIGHT);
+    }
+    g_mutex_unlock(&rc->lock);
+}
+
+// Add one encoder: camera tee -> queue -> videoscale -> capsfilter -> x264enc -> tee (one branch per peer)
+static gboolean add_layer(GstElement *pipeline, GstElement *capturetee, Layer *layer, guint index)
+{
+    GstElement *scaler;
+    GstCaps *caps;
+
+    layer->queue = make_element("queue", "layerqueue", index);
+    scaler = make_element("videoscale", "scaler", index);
+    layer->scalefilter = make_element("capsfilter", "scalefilter", index);
+    layer->encoder = make_element("x264enc", "encoder", index);
+    layer->tee = make_element("tee", "tee", index);
+
+    if (!layer->queue || !scaler || !layer->scalefilter || !layer->encoder || !layer->tee)
+        return FALSE;
+
+    // An encoder that cannot keep up skips camera frames instead of holding up the other layers
+    gst_util_set_object_arg(G_OBJECT(layer->queue), "leaky", "downstream");
+    g_object_set(layer->queue, "max-size-buffers", 2, "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+
+    caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, layer_specs[index].width, "height", G_TYPE_INT,
+                               layer_specs[index].height, NULL);
+    g_object_set(layer->scalefilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    // Set encoder properties, low latency so the control loop sees the effect of a change quickly
+    gst_util_set_object_arg(G_OBJECT(layer->encoder), "tune", "zerolatency");
+    gst_util_set_object_arg(G_OBJECT(layer->encoder), "speed-preset", "superfast");
+    g_object_set(layer->encoder, "bitrate", layer_specs[index].bitrate * 100 / (100 + fec_percentage), "key-int-max", 60,
+                 "threads", layer->n_cpus, NULL);
+
+    gst_bin_add_many(GST_BIN(pipeline), layer->queue, scaler, layer->scalefilter, layer->encoder, layer->tee, NULL);
+    return gst_element_link_many(capturetee, layer->queue, scaler, layer->scalefilter, layer->encoder, layer->tee, NULL);
+}
+
+// Split the cores between the layers. The small layers need a fraction of a core, so the top layer gets the rest
+static void assign_cpus(RateControl *rc)
+{
+    guint i, n_cpus = g_get_num_processors();
+
+    for (i = 0; i < rc->n_layers; i++)
+    {
+        if (n_cpus <= rc->n_layers)
+        {
+            rc->layers[i].first_cpu = i % n_cpus;
+            rc->layers[i].n_cpus = 1;
+        }
+        else if (i == 0)
+        {
+            rc->layers[i].first_cpu = 0;
+            rc->layers[i].n_cpus = n_cpus - (rc->n_layers - 1);
+        }
+        else
+        {
+            rc->layers[i].first_cpu = n_cpus - rc->n_layers + i;
+            rc->layers[i].n_cpus = 1;
+        }
+    }
+}
+
+// Sync bus handler, pins a layer's streaming thread as it starts. x264 creates its own threads from
+// there later on, and they inherit the affinity
+static GstBusSyncReply on_sync_message(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+    RateControl *rc = user_data;
+    GstStreamStatusType type;
+    GstElement *owner;
+    guint i;
+
+    (void)bus;
+
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS || rc->n_layers < 2)
+        return GST_BUS_PASS;
+
+    // ENTER is posted from the new thread itself
+    gst_message_parse_stream_status(msg, &type, &owner);
+    if (type != GST_STREAM_STATUS_TYPE_ENTER)
+        return GST_BUS_PASS;
+
+    for (i = 0; i < rc->n_layers; i++)
+    {
+        if (owner != rc->layers[i].queue)
+            continue;
+#ifdef __linux__
+        {
+            cpu_set_t cpus;
+            guint cpu;
+
+            CPU_ZERO(&cpus);
+            for (cpu = 0; cpu < rc->layers[i].n_cpus; cpu++)
+                CPU_SET(rc->layers[i].first_cpu + cpu, &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+                g_printerr("Could not pin layer %u to its cores.\n", i);
+        }
+#endif
+    }
+
+    return GST_BUS_PASS;
+}
+
+// Add the send branch for one peer: layer tees -> selector -> leaky queue -> payloader -> rtpbin session -> udpsink
+static gboolean add_peer(GstElement *pipeline, RateControl *rc, GstElement *rtpbin, GstElement *rtcptee, Peer *peer)
+{
+    GstElement *queue, *rtpsink, *rtcpsink;
+    GstPad *teepad;
+    GObject *session;
+    guint i;
+
+    peer->selector = make_element("input-selector", "selector", peer->index);
+    queue = make_element("queue", "queue", peer->index);
+    peer->payloader = make_element("rtph264pay", "payloader", peer->index);
+    rtpsink = make_element("udpsink", "rtpsink", peer->index);
+    rtcpsink = make_element("udpsink", "rtcpsink", peer->index);
+
+    if (!peer->selector || !queue || !peer->payloader || !rtpsink || !rtcpsink)
+        return FALSE;
+
+    // Frames of the layers the peer is not on are dropped right at the selector
+    g_object_set(peer->selector, "sync-streams", FALSE, "cache-buffers", FALSE, NULL);
+
+    // Only the queue holds data for this peer, so it drops the oldest frames rather than block the encoders
+    gst_util_set_object_arg(G_OBJECT(queue), "leaky", "downstream");
+    g_object_set(queue, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", (guint64)PEER_QUEUE_MS * GST_MSECOND,
+                 NULL);
+    g_object_set(peer->payloader, "pt", H264_PT, "config-interval", -1, NULL);
+
+    // RTP and RTCP go to the peer, its reports come back to us through the shared RTCP socket
+    g_object_set(rtpsink, "host", peer->host, "port", RTP_PORT, NULL);
+    g_object_set(rtcpsink, "host", peer->host, "port", RTCP_SR_PORT, "sync", FALSE, "async", FALSE, NULL);
+
+    gst_bin_add_many(GST_BIN(pipeline), peer->selector, queue, peer->payloader, rtpsink, rtcpsink, NULL);
+    for (i = 0; i < rc->n_layers; i++)
+    {
+        peer->layer_pads[i] = gst_element_request_pad_simple(peer->selector, "sink_%u");
+        teepad = gst_element_request_pad_simple(rc->layers[i].tee, "src_%u");
+        if (gst_pad_link(teepad, peer->layer_pads[i]) != GST_PAD_LINK_OK)
+        {
+            gst_object_unref(teepad);
+            return FALSE;
+        }
+        gst_object_unref(teepad);
+        gst_pad_add_probe(peer->layer_pads[i], GST_PAD_PROBE_TYPE_BUFFER, on_layer_buffer, peer, NULL);
+    }
+    g_object_set(peer->selector, "active-pad", peer->layer_pads[0], NULL);
+    peer->pending_layer = -1;
+
+    if (!gst_element_link_many(peer->selector, queue, peer->payloader, NULL) ||
+        !link_session(peer->payloader, "src", rtpbin, "send_rtp_sink_%u", peer->index) ||
+        !link_session(rtpbin, "send_rtp_src_%u", rtpsink, "sink", peer->index) ||
+        !link_session(rtpbin, "send_rtcp_src_%u", rtcpsink, "sink", peer->index) ||
+        !link_session(rtcptee, "src_%u", rtpbin, "recv_rtcp_sink_%u", peer->index))
+        return FALSE;
+
+    // Send sender reports often enough for the receiver to report RTT back at the same pace
+    g_signal_emit_by_name(rtpbin, "get-internal-session", peer->index, &session);
+    g_object_set(session, "rtcp-min-interval", (guint64)RTCP_MIN_INTERVAL, NULL);
+    g_object_unref(session);
+
+    return TRUE;
+}
+
+// The camera copies a frame instead of handing over its own buffer once its pool runs low, and every branch off the
+// camera tee can hold a few of them. Raise the pool's minimum by that once the allocation query has been answered
+static GstPadProbeReturn on_allocation_query(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+    guint held = GPOINTER_TO_UINT(user_data), size = 0, min = 0, max = 0;
+    GstBufferPool *pool = NULL;
+    GstCaps *caps = NULL;
+    GstVideoInfo video_info;
+
+    (void)pad;
+
+    // Query probes are called before (PUSH) and after (PULL) downstream answered
+    if (!(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_PULL) || GST_QUERY_TYPE(query) != GST_QUERY_ALLOCATION)
+        return GST_PAD_PROBE_OK;
+
+    if (gst_query_get_n_allocation_pools(query) > 0)
+    {
+        gst_query_parse_nth_allocation_pool(query, 0, &pool, &size, &min, &max);
+        gst_query_set_nth_allocation_pool(query, 0, pool, size, min + held, max ? MAX(max, min + held) : 0);
+        if (pool)
+            gst_object_unref(pool);
+    }
+    else
+    {
+        gst_query_parse_allocation(query, &caps, NULL);
+        if (caps && gst_video_info_from_caps(&video_info, caps))
+            size = GST_VIDEO_INFO_SIZE(&video_info);
+        gst_query_add_allocation_pool(query, NULL, size, held, 0);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+// Shared memory carries no caps, so tell the user what a shmsrc reading the tap has to be told
+static GstPadProbeReturn on_tap_caps(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    GstCaps *caps;
+    gchar *description;
+
+    (void)pad;
+    (void)user_data;
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS)
+    {
+        gst_event_parse_caps(event, &caps);
+        description = gst_caps_to_string(caps);
+        g_print("Raw frames shared at %s: %s\n", tap_path, description);
+        g_free(description);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+// In-process consumer of the raw frames. Mapping for reading gives us the camera's own memory, nothing is copied
+static GstFlowReturn on_new_sample(GstElement *appsink, gpointer user_data)
+{
+    GstClockTime *next_report = user_data;
+    GstSample *sample = NULL;
+    GstBuffer *buffer;
+    GstVideoInfo info;
+    GstVideoFrame frame;
+    const guint8 *luma;
+    guint64 sum = 0, n = 0;
+    gint x, y, stride, pixel_stride;
+
+    g_signal_emit_by_name(appsink, "pull-sample", &sample);
+    if (!sample)
+        return GST_FLOW_EOS;
+
+    buffer = gst_sample_get_buffer(sample);
+    if (GST_BUFFER_PTS_IS_VALID(buffer) && GST_BUFFER_PTS(buffer) >= *next_report &&
+        gst_video_info_from_caps(&info, gst_sample_get_caps(sample)) && gst_video_frame_map(&frame, &info, buffer, GST_MAP_READ))
+    {
+        // Every 8th pixel of the luma plane is plenty for a brightness figure
+        luma = GST_VIDEO_FRAME_COMP_DATA(&frame, 0);
+        stride = GST_VIDEO_FRAME_COMP_STRIDE(&frame, 0);
+        pixel_stride = GST_VIDEO_FRAME_COMP_PSTRIDE(&frame, 0);
+        for (y = 0; y < GST_VIDEO_FRAME_COMP_HEIGHT(&frame, 0); y += 8)
+            for (x = 0; x < GST_VIDEO_FRAME_COMP_WIDTH(&frame, 0); x += 8, n++)
+                sum += luma[y * stride + x * pixel_stride];
+        gst_video_frame_unmap(&frame);
+
+        g_print("Frame at %" GST_TIME_FORMAT ": mean brightness %" G_GUINT64_FORMAT "\n", GST_TIME_ARGS(GST_BUFFER_PTS(buffer)),
+                n ? sum / n : 0);
+        *next_report = GST_BUFFER_PTS(buffer) + GST_SECOND;
+    }
+    gst_sample_unref(sample);
+
+    return GST_FLOW_OK;
+}
+
+// Add a raw frame branch: camera tee -> leaky queue -> sink, a slow local consumer loses frames instead of stalling the encoders
+static gboolean add_tap(GstElement *pipeline, GstElement *capturetee, GstElement *sink, guint index)
+{
+    GstElement *queue = make_element("queue", "tapqueue", index);
+
+    if (!queue || !sink)
+        return FALSE;
+
+    gst_util_set_object_arg(G_OBJECT(queue), "leaky", "downstream");
+    g_object_set(queue, "max-size-buffers", 1, "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+
+    gst_bin_add_many(GST_BIN(pipeline), queue, sink, NULL);
+    return gst_element_link_many(capturetee, queue, sink, NULL);
+}
 
 int main(int argc, char *argv[])
 {
-    GstElement *pipeline, *source, *filter, *encoder, *payloader, *sink;
+    GstElement *pipeline, *source, *filter, *converter, *capturetee, *rtpbin, *rtcpsrc, *rtcptee, *shmsink = NULL, *appsink = NULL;
     GstCaps *caps;
+    GstPad *pad;
     GstBus *bus;
-    GstMessage *msg;
     GstStateChangeReturn ret;
+    Metrics *metrics;
+    RateControl rc = {0};
+    GstClockTime next_report = 0;
+    gchar *caps_description;
+    guint n_branches;
+    GOptionContext *context;
+    GError *error = NULL;
+    gint i, result;
+
+    // Initialize GStreamer, together with our own options
+    context = g_option_context_new("[PEER_IP...]");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("Could not parse the options: %s\n", error->message);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(context);
+    fec_percentage = CLAMP(fec_percentage, 0, MAX_FEC_PERCENTAGE);
+    if (use_red && fec_percentage == 0)
+    {
+        // The receivers are told about RED separately, both ends have to agree on what gets retransmitted
+        g_printerr("--red needs --fec, RED only wraps media and FEC packets together.\n");
+        return -1;
+    }
+    rc.n_layers = CLAMP(n_layers, 1, MAX_LAYERS);
 
-    // Initialize GStreamer
-    gst_init(&argc, &argv);
+    // Peers (unicast or multicast addresses) from the command line, the receiver's IP address by default
+    for (i = 1; i < argc && rc.n_peers < MAX_PEERS; i++)
+        rc.peers[rc.n_peers++].host = argv[i];
+    if (argc > MAX_PEERS + 1)
+        g_printerr("Only sending to the first %d peers.\n", MAX_PEERS);
+    if (rc.n_peers == 0)
+        rc.peers[rc.n_peers++].host = IP_ADDRESS;
+    for (i = 0; i < (gint)rc.n_peers; i++)
+    {
+        rc.peers[i].index = i;
+        rc.peers[i].bitrate = START_BITRATE;
+    }
 
     // Create the elements
-    source = gst_element_factory_make("v4l2src", "source");
+    source = gst_element_factory_make(test_source ? "videotestsrc" : "v4l2src", "source");
     filter = gst_element_factory_make("capsfilter", "filter");
-    encoder = gst_element_factory_make("x264enc", "encoder");
-    payloader = gst_element_factory_make("rtph264pay", "payloader");
-    sink = gst_element_factory_make("udpsink", "sink");
+    converter = gst_element_factory_make("videoconvert", "converter");
+    capturetee = gst_element_factory_make("tee", "capturetee");
+    rtpbin = gst_element_factory_make("rtpbin", "rtpbin");
+    rtcpsrc = gst_element_factory_make("udpsrc", "rtcpsrc");
+    rtcptee = gst_element_factory_make("tee", "rtcptee");
 
     // Create the pipeline
     pipeline = gst_pipeline_new("video-conference-sender");
 
-    if (!pipeline || !source || !filter || !encoder || !payloader || !sink)
+    if (tap_path)
+        shmsink = gst_element_factory_make("shmsink", "shmsink");
+    if (analytics)
+        appsink = gst_element_factory_make("appsink", "appsink");
+
+    if (!pipeline || !source || !filter || !converter || !capturetee || !rtpbin || !rtcpsrc || !rtcptee ||
+        (tap_path && !shmsink) || (analytics && !appsink))
     {
         g_printerr("One or more elements could not be created. Exiting.\n");
         return -1;
     }
 
-    // Set source properties
-    g_object_set(source, "device", "/dev/video0", NULL); // Change this to match your camera device
-    g_object_set(filter, "caps", gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, WIDTH, "height", G_TYPE_INT, HEIGHT, NULL), NULL);
+    // Set source properties. With mmap the camera's own buffers travel down the pipeline, with dmabuf they are
+    // exported so that elements which can import them do not map them at all
+    if (test_source)
+        g_object_set(source, "is-live", TRUE, NULL);
+    else
+    {
+        g_object_set(source, "device", "/dev/video0", NULL); // Change this to match your camera device
+        gst_util_set_object_arg(G_OBJECT(source), "io-mode", io_mode ? io_mode : "mmap");
+    }
+
+    // Prefer a format the encoder takes as it is, so the converter passes the camera's buffers through untouched.
+    // It only converts for cameras that offer none of them (mostly YUY2 only webcams)
+    caps_description = g_strdup_printf("video/x-raw, format=(string){ %s }, width=(int)%d, height=(int)%d; "
+                                       "video/x-raw, width=(int)%d, height=(int)%d",
+                                       CAPTURE_FORMATS, WIDTH, HEIGHT, WIDTH, HEIGHT);
+    caps = gst_caps_from_string(caps_description);
+    g_free(caps_description);
+    g_object_set(filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    // Each layer and tap queue holds up to two camera frames while the element behind it works on a third
+    n_branches = rc.n_layers + (shmsink ? 1 : 0) + (appsink ? 1 : 0);
+    pad = gst_element_get_static_pad(source, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM, on_allocation_query, GUINT_TO_POINTER(n_branches * 3), NULL);
+    gst_object_unref(pad);
+
+    // Local consumers of the raw frames, neither may hold up the pipeline when nobody reads
+    if (shmsink)
+    {
+        g_object_set(shmsink, "socket-path", tap_path, "shm-size", (guint)(WIDTH * HEIGHT * 3 * TAP_FRAMES), "wait-for-connection",
+                     FALSE, "sync", FALSE, "async", FALSE, NULL);
+        pad = gst_element_get_static_pad(shmsink, "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, on_tap_caps, NULL, NULL);
+        gst_object_unref(pad);
+    }
+    if (appsink)
+    {
+        g_object_set(appsink, "emit-signals", TRUE, "drop", TRUE, "max-buffers", 1, "sync", FALSE, NULL);
+        g_signal_connect(appsink, "new-sample", G_CALLBACK(on_new_sample), &next_report);
+    }
+
+    // Set RTP properties, AVPF lets the receivers send NACKs and keyframe requests right away
+    gst_util_set_object_arg(G_OBJECT(rtpbin), "rtp-profile", "avpf");
+    g_object_set(rtcpsrc, "port", RTCP_RR_PORT, NULL);
 
-    // Set sink properties
-    g_object_set(sink, "host", IP_ADDRESS, "port", PORT, NULL);
+    // Loss recovery elements are handed to rtpbin when it creates a session, i.e. on linking
+    rc.bitrate = START_BITRATE * 100 / (100 + fec_percentage);
+    g_mutex_init(&rc.lock);
+    g_signal_connect(rtpbin, "request-fec-encoder", G_CALLBACK(on_request_fec_encoder), &rc);
+    g_signal_connect(rtpbin, "request-aux-sender", G_CALLBACK(on_request_aux_sender), &rc);
 
     // Add elements to the pipeline
-    gst_bin_add_many(GST_BIN(pipeline), source, filter, encoder, payloader, sink, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), source, filter, converter, capturetee, rtpbin, rtcpsrc, rtcptee, NULL);
 
-    // Link elements
-    if (!gst_element_link_many(source, filter, encoder, payloader, sink, NULL))
+    // Link elements, the camera is captured once and every layer is encoded once, whatever the number of peers
+    assign_cpus(&rc);
+    if (!gst_element_link_many(source, filter, converter, capturetee, NULL) || !gst_element_link(rtcpsrc, rtcptee))
     {
         g_printerr("Elements could not be linked. Exiting.\n");
         gst_object_unref(pipeline);
         return -1;
     }
+    for (i = 0; i < (gint)rc.n_layers; i++)
+    {
+        if (!add_layer(pipeline, capturetee, &rc.layers[i], i))
+        {
+            g_printerr("Could not set up simulcast layer %d. Exiting.\n", i);
+            gst_object_unref(pipeline);
+            return -1;
+        }
+    }
+    if ((shmsink && !add_tap(pipeline, capturetee, shmsink, 0)) || (appsink && !add_tap(pipeline, capturetee, appsink, 1)))
+    {
+        g_printerr("Could not set up the raw frame tap. Exiting.\n");
+        gst_object_unref(pipeline);
+        return -1;
+    }
+    for (i = 0; i < (gint)rc.n_peers; i++)
+    {
+        if (!add_peer(pipeline, &rc, rtpbin, rtcptee, &rc.peers[i]))
+        {
+            g_printerr("Could not set up the stream to %s. Exiting.\n", rc.peers[i].host);
+            gst_object_unref(pipeline);
+            return -1;
+        }
+    }
+
+    // Run the control loop on every report from the receivers
+    g_signal_connect(rtpbin, "on-ssrc-active", G_CALLBACK(on_ssrc_active), &rc);
+
+    // Pin the encoder threads as they start, the other messages go on to the bus watch in metrics_run()
+    bus = gst_element_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, on_sync_message, &rc, NULL);
+    gst_object_unref(bus);
+
+    // Time every element with a single input and output, the ones rtpbin adds later included
+    metrics = metrics_new(pipeline, "sender");
 
     // Set the pipeline to the playing state
     ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE)
     {
         g_printerr("Unable to set the pipeline to the playing state. Exiting.\n");
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        metrics_free(metrics);
         gst_object_unref(pipeline);
         return -1;
     }
+    for (i = 0; i < (gint)rc.n_peers; i++)
+        g_print("Sending to %s\n", rc.peers[i].host);
 
-    // Wait until error or EOS
-    bus = gst_element_get_bus(pipeline);
-    msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
-
-    // Parse message
-    if (msg != NULL)
-    {
-        GError *err;
-        gchar *debug_info;
-
-        switch (GST_MESSAGE_TYPE(msg))
-        {
-        case GST_MESSAGE_ERROR:
-            gst_message_parse_error(msg, &err, &debug_info);
-            g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
-            g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
-            g_clear_error(&err);
-            g_free(debug_info);
-            break;
-        case GST_MESSAGE_EOS:
-            g_print("End-Of-Stream reached.\n");
-            break;
-        default:
-            // Should not be reached
-            g_printerr("Unexpected message received.\n");
-            break;
-        }
-
-        gst_message_unref(msg);
-    }
+    // Handle bus messages and print the metrics until error or EOS
+    result = metrics_run(metrics);
 
     // Free resources
-    gst_object_unref(bus);
     gst_element_set_state(pipeline, GST_STATE_NULL);
+    metrics_free(metrics);
     gst_object_unref(pipeline);
+    g_mutex_clear(&rc.lock);
+    g_free(io_mode);
+    g_free(tap_path);
 
-    return 0;
+    return result;
 }
@@ -3,4 +3,22 @@
 
 // For #includes or #defines of sender.c & receiver.c
 
+// Port layout (same on both sides)
+#define RTP_PORT 5000     // RTP video, sender -> receiver
+#define RTCP_SR_PORT 5001 // RTCP sender reports, sender -> receiver
+#define RTCP_RR_PORT 5005 // RTCP receiver reports (loss, jitter, RTT), receiver -> sender
+
+// RTP stream description
+#define H264_PT 96
+#define RTX_PT 97     // Retransmissions (RFC 4588) of H264_PT, or of RED_PT when RED is on
+#define ULPFEC_PT 122 // Forward error correction (RFC 5109)
+#define RED_PT 123    // Redundant encoding (RFC 2198) wrapping media and FEC packets
+#define RTP_CAPS "application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264, payload=(int)96"
+
+// RTCP report interval, the default 5s is too slow to steer the bitrate with
+#define RTCP_MIN_INTERVAL (1 * GST_SECOND)
+
+// How long the sender keeps packets around for retransmission, in ms
+#define RTX_HISTORY 1000
+
 #endif /* VIDEO_CONFERENCING_H */